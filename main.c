@@ -1,6 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define BOARD_SIZE 8
 #define MAX_MOVES 40
@@ -13,6 +25,19 @@
 #define CASTLE_RIGHT 3
 #define PROMOTED -10
 
+#define INDEX_MAGIC "CIDX"
+#define INDEX_VERSION 3
+#define NO_NEXT_MOVE 0xFFFF
+#define MAX_THREADS 64
+#define BATCH_LINES 4096
+#define MAX_LINE 256
+#define MAX_LABEL 16
+#define MAX_LEGAL 256
+#define PN_INF 0x3FFFFFFF
+#define MATE_MEMORY 64 // Default mate solver node table size in MB
+#define MAX_FUZZ_PLIES 300
+#define MAX_FUZZ_REPORTS 10
+
 //{ Structs
 typedef enum Type{
     Pawn = 0,
@@ -35,6 +60,7 @@ typedef struct piece{
     int owner;
     int flag;
     move* (*getPossibleMoves)(int rank, int file, struct piece*** board, int owner, int* cnt);
+    struct piece *next; // Links released pieces in the piece pool
 } piece;
 typedef struct moveRecord{
     int player;
@@ -44,12 +70,130 @@ typedef struct moveRecord{
     move capturedPos;
     struct moveRecord *next;
 } moveRecord;
+
+// On-disk game index: header, then the byte offset of every game in the game file, then entries sorted by key
+typedef struct indexHeader{
+    char magic[4];
+    uint32_t version;
+    uint32_t gameCount;
+    uint32_t reserved;
+    uint64_t entryCount;
+} indexHeader;
+typedef struct indexEntry{
+    uint64_t key;
+    uint32_t game;
+    uint16_t ply;
+    uint16_t next; // Move played from this position, or NO_NEXT_MOVE if the game ended here
+} indexEntry;
+typedef struct gameIndex{
+    const void *map;
+    size_t size;
+    const indexHeader *header;
+    const uint64_t *gameOffsets;
+    const indexEntry *entries;
+} gameIndex;
+typedef struct indexJob{
+    const char *games;
+    size_t size;
+    const uint64_t *gameOffsets;
+    uint32_t gameCount;
+    atomic_uint nextGame;
+} indexJob;
+typedef struct indexWorker{
+    indexJob *job;
+    indexEntry *entries;
+    size_t cnt;
+    size_t cap;
+    uint32_t badGames;
+    int outOfMemory;
+    int started;
+    pthread_t thread;
+} indexWorker;
+typedef struct classifyBatch{
+    char (*lines)[MAX_LINE];
+    char (*labels)[MAX_LABEL];
+    int cnt;
+    atomic_int nextLine;
+} classifyBatch;
+typedef struct legalMove{
+    move start;
+    move end; // end.flag is the flag the move was generated with
+    Type promo;
+} legalMove;
+typedef enum genStage{
+    GenStart = 0,
+    GenCaptures,
+    GenPromotions,
+    GenChecks,
+    GenQuiet,
+    GenDone
+} genStage;
+// Staged move generator. Each stage is only generated once the previous one has been used up
+typedef struct moveGen{
+    piece ***board;
+    int owner;
+    int capturesOnly;
+    genStage stage;
+    legalMove moves[MAX_LEGAL]; // Moves of the current stage, in the order they are handed out
+    int cnt;
+    int next;
+    legalMove quiet[MAX_LEGAL]; // Quiet moves that turned out not to give check, for the last stage
+    int quietCnt;
+    int checksFirst; // Whether quiet moves that give check are handed out before the rest
+} moveGen;
+// Node of the mate solver's proof-number tree. Children of a node are stored next to each other in the table
+typedef struct mateNode{
+    legalMove mv;
+    uint32_t proof;
+    uint32_t disproof;
+    int32_t parent;
+    int32_t firstChild; // -1 until the node is expanded
+    int32_t childCnt;
+} mateNode;
+// One tile of a position snapshot. Packed with no padding, so snapshots can be compared with memcmp
+typedef struct square{
+    int16_t type; // None if the tile is empty
+    int16_t owner;
+    int32_t flag;
+} square;
+// Fixed-size copy of everything that defines a position, which can be copied with memcpy
+// Castling rights and en passant live in the piece flags, as they do on the board
+typedef struct position{
+    square squares[BOARD_SIZE][BOARD_SIZE];
+    int turn;
+    move kingPos[2];
+} position;
+typedef struct fuzzJob{
+    uint64_t seed;
+    uint32_t gameCount;
+    atomic_uint nextGame;
+    atomic_int reports; // Failures printed so far, to keep the output readable
+} fuzzJob;
+typedef struct fuzzWorker{
+    fuzzJob *job;
+    uint64_t games;
+    uint64_t moves;
+    uint64_t failures;
+    int started;
+    pthread_t thread;
+} fuzzWorker;
+typedef struct mateSolver{
+    mateNode *nodes;
+    size_t cap;
+    size_t used;
+    uint64_t expanded;
+    int full;
+    int disproven; // Longest mate length ruled out so far
+} mateSolver;
 //}
 
 
 // Function prototypes
 //{
 int playGame();
+int tryMove(piece ***board, move cur, move tar);
+int makeMove(piece ***board, move cur, move tar);
+int cacheCheck(piece ***board, int player);
 
 // Piece movement
 void addPiece(piece temp, piece ***board, int rank, int file, int owner);
@@ -69,12 +213,25 @@ move *getQueenMoves(int rank, int file, piece ***board, int owner, int *cnt);
 move *getKingMoves(int rank, int file, piece ***board, int owner, int *cnt);
 void addDiagonalMoves(int rank, int file, piece ***board, int owner, int *cnt, move *moves);
 void addStraightMoves(int rank, int file, piece ***board, int owner, int *cnt, move *moves);
+void addPawnCaptures(int rank, int file, piece ***board, int owner, int *cnt, move *moves);
+void addCaptureMoves(int rank, int file, piece ***board, int owner, int *cnt, move *moves);
+
+// Staged move generation
+void startMoveGen(moveGen *gen, piece ***board, int owner, int capturesOnly);
+int nextMove(moveGen *gen, legalMove *mv);
+void addStageMove(moveGen *gen, move start, move end, Type promo);
+void genCaptures(moveGen *gen);
+void genPromotions(moveGen *gen);
+void genQuietMoves(moveGen *gen);
+int captureScore(piece ***board, legalMove mv);
 
 // Game end conditions
 int isCheck(piece ***board, int rank, int file, int owner);
-int hasLegalKingMove(int rank, int file, piece ***board, int owner);
 int isSimulatedCheck(piece ***board, int curRank, int curFile, int tarRank, int tarFile, int owner);
 int isStalemate(piece ***board, int owner);
+int getLegalMoves(piece ***board, int owner, legalMove *moves, int max);
+int getOrderedMoves(piece ***board, int owner, legalMove *moves, int max);
+int countLegalMoves(piece ***board, int owner);
 
 // Move validation
 void addPossibleMove(move *moves, int *len, int rank, int file, int flag);
@@ -87,11 +244,18 @@ int isPossibleMove(int rank, int file, move *moves, int cnt, int *flag);
 
 // Initialization
 piece ***makeBoard();
+void clearBoard(piece ***board);
+int loadFen(piece ***board, const char *fen);
+Type pieceType(char rep);
 
 // Input/Output
 void readyBoard(piece ***board);
 void printBoard(piece ***board);
 void freeBoard(piece ***board);
+piece *newPiece();
+void releasePiece(piece *p);
+moveRecord *newRecord();
+void freePools();
 void printLine();
 move getMoveInput();
 void clearstdin();
@@ -99,6 +263,63 @@ void clearstdin();
 // Move history
 moveRecord *storeMove(moveRecord *head, move start, move end, Type captured, move capturedPos, int owner);
 moveRecord *undoMove(moveRecord *head, piece ***board);
+void freeMoves(moveRecord *head);
+
+// Position snapshots
+void savePosition(piece ***board, position *pos);
+void loadPosition(piece ***board, const position *pos);
+int copyMake(piece ***board, position *saved, legalMove mv);
+
+// Game database
+void initZobrist();
+uint64_t splitmix(uint64_t *state);
+uint64_t positionKey(piece ***board);
+int parseMove(const char *str, size_t len, move *cur, move *tar, Type *promo);
+uint16_t encodeMove(move cur, move tar, Type promo);
+void printEncodedMove(uint16_t code);
+void *runIndexWorker(void *arg);
+int indexGame(piece ***board, const char *text, const char *end, uint32_t game, indexWorker *worker);
+void addIndexEntry(indexWorker *worker, uint64_t key, uint32_t game, uint16_t ply, uint16_t next);
+int compareEntries(const void *a, const void *b);
+int writeMergedRuns(FILE *out, indexWorker *workers, int threads);
+int buildIndex(const char *gamePath, const char *indexPath, int threads);
+int openIndex(const char *indexPath, gameIndex *index);
+void closeIndex(gameIndex *index);
+size_t findPosition(const gameIndex *index, uint64_t key);
+
+// Position classification
+void classifyPosition(piece ***board, const char *fen, char *label);
+void *runClassifyWorker(void *arg);
+int readBatch(FILE *in, classifyBatch *batch);
+int classifyFile(const char *path, int threads);
+
+// Mate solver
+int solveMate(piece ***board, int maxMoves, size_t memory, mateSolver *solver);
+int proveMate(mateSolver *solver, piece ***board, int moves);
+void expandMateNode(mateSolver *solver, piece ***board, int32_t idx, int ply, int maxPly);
+void updateMateNode(mateSolver *solver, int32_t idx, int ply);
+void printMateLine(const mateSolver *solver);
+int mateCommand(const char *fen, int maxMoves, size_t memory);
+
+// Rules fuzzer
+void *runFuzzWorker(void *arg);
+int fuzzGame(piece ***board, fuzzJob *job, uint32_t game, uint64_t *moves);
+int fuzzCheck(fuzzJob *job, int ok, const char *what, uint32_t game, int ply, const legalMove *played);
+int isCheckReference(piece ***board, int owner);
+int kingsMatch(piece ***board);
+int samePosition(const position *a, const position *b);
+int fuzzRules(uint32_t games, uint64_t seed, int threads);
+double wallTime();
+
+// Platform
+const void *mapFile(const char *path, size_t *size);
+void unmapFile(const void *map, size_t size);
+int numCores();
+
+// Command line
+int runCommand(int argc, char **argv);
+int findGames(const char *gamePath, char **moves, int cnt);
+char *indexPathFor(const char *gamePath);
 
 //}
 
@@ -111,12 +332,26 @@ const piece pieceTypes[] = {
         { Queen, 'Q', 0, 0, &getQueenMoves },
         { King, 'K', 0, CAN_CASTLE  , &getKingMoves }
 };
-int turn = 0;
-moveRecord *moveRecords = NULL;
-move kingPos[2];
+// Game state is per thread so that batch tools can replay games in parallel
+_Thread_local int turn = 0;
+_Thread_local moveRecord *moveRecords = NULL;
+_Thread_local move kingPos[2];
+_Thread_local Type promoteTo = None; // Piece to promote to without asking the user (None asks)
+_Thread_local piece *piecePool = NULL; // Released pieces and move records, reused before asking malloc
+_Thread_local moveRecord *recordPool = NULL;
+uint64_t zobrist[2][None][BOARD_SIZE * BOARD_SIZE];
+uint64_t zobristCastle[BOARD_SIZE * BOARD_SIZE];
+uint64_t zobristPassant[BOARD_SIZE];
+uint64_t zobristTurn;
 
-int main()
+int main(int argc, char **argv)
 {
+    initZobrist();
+    if(argc > 1){
+        return runCommand(argc - 1, argv + 1);
+    }
+
+
     int scores[2] = { 0 };
     char input;
     printf("Welcome to Chess!\n");
@@ -150,12 +385,7 @@ int playGame(){
 
         int player = turn % 2;
 
-        // Cache if king is in check
-        if(isCheck(board, kingPos[player].rank, kingPos[player].file, player)){
-            kingPos[player].flag = 1;
-        } else {
-            kingPos[player].flag = 0;
-        }
+        cacheCheck(board, player);
         if(isStalemate(board, player)){
             // The only difference between a stalemate and a checkmate is whether the king is in check
             if(kingPos[player].flag == 1){
@@ -191,27 +421,13 @@ int playGame(){
             printf("Where would you like to move this piece to?\n");
             move tar = getMoveInput();
 
-            // Check if move is possible
-            int cnt, flag;
-            move *moves = selected->getPossibleMoves(cur.rank, cur.file, board, selected->owner, &cnt);
-            if(isPossibleMove(tar.rank, tar.file, moves, cnt, &flag)){
-                // Carry out move
-                processMove(board, cur.rank, cur.file, tar.rank, tar.file, flag);
-                if(board[tar.rank][tar.file]->type == King){
-                    flag = 0;
-                }
-                board[tar.rank][tar.file]->flag = flag;
-
-                // Legal moves cannot put the king in check
-                if(isCheck(board, kingPos[player].rank, kingPos[player].file, player)){
-                    undoMove(moveRecords, board);
-                    printf("Invalid move.\n");
+            if(tryMove(board, cur, tar)){
+                if(moveRecords->captured != None){
+                    printf("Captured %c\n", pieceTypes[moveRecords->captured].rep);
                 }
-                turn++;
             } else {
                 printf("Invalid move.\n");
             }
-            free(moves);
         } else if(selected != NULL && selected->owner != player){
             printf("You don't own that piece!\n");
         } else {
@@ -221,29 +437,70 @@ int playGame(){
     return res;
     freeBoard(board);
 }
+// Plays the move from cur to tar for the player to move if it is legal
+// Assumes the mover's check status has been cached with cacheCheck. Returns 1 if the move was played
+int tryMove(piece ***board, move cur, move tar){
+    int player = turn % 2;
+    if(!isValidTile(cur.rank, cur.file) || !isAllyPiece(cur.rank, cur.file, player, board)){
+        return 0;
+    }
+    piece *selected = board[cur.rank][cur.file];
+
+    // Check if move is possible
+    int cnt, flag, res = 0;
+    move *moves = selected->getPossibleMoves(cur.rank, cur.file, board, selected->owner, &cnt);
+    if(isPossibleMove(tar.rank, tar.file, moves, cnt, &flag)){
+        res = makeMove(board, cur, (move) { tar.rank, tar.file, flag });
+    }
+    free(moves);
+    return res;
+}
+// Plays a possible move (tar.flag being the flag it was generated with) for the player to move
+// Returns 1 if the move was played, or 0 if it was taken back for leaving the king in check
+int makeMove(piece ***board, move cur, move tar){
+    int player = turn % 2, flag = tar.flag, res = 0;
+    processMove(board, cur.rank, cur.file, tar.rank, tar.file, flag);
+    if(board[tar.rank][tar.file]->type == King){
+        flag = 0;
+    }
+    board[tar.rank][tar.file]->flag = flag;
+
+    // Legal moves cannot put the king in check. Undoing also steps the turn back
+    if(isCheck(board, kingPos[player].rank, kingPos[player].file, player)){
+        moveRecords = undoMove(moveRecords, board);
+    } else {
+        res = 1;
+    }
+    turn++;
+    return res;
+}
+// Caches whether the player's king is in check, which castling relies on. Returns the cached flag
+int cacheCheck(piece ***board, int player){
+    kingPos[player].flag = isCheck(board, kingPos[player].rank, kingPos[player].file, player);
+    return kingPos[player].flag;
+}
 
 //{ Piece movement
 // Adds a piece to the board
 void addPiece(piece temp, piece ***board, int rank, int file, int owner){
-    if(board[rank][file] != NULL){
-        free(board[rank][file]);
-    }
-    piece *newPiece = malloc(sizeof(piece));
-    memcpy(newPiece, &temp, sizeof(temp));
-    newPiece->owner = owner;
-    board[rank][file] = newPiece;
+    releasePiece(board[rank][file]);
+    piece *added = newPiece();
+    memcpy(added, &temp, sizeof(temp));
+    added->owner = owner;
+    board[rank][file] = added;
 }
 // Processes a move on the board. Does not check for valid moves. Returns the position of the captured piece, if any
 void processMove(piece ***board, int curRank, int curFile, int targetRank, int targetFile, int flag){
     Type capturedType = None;
     move capturedPos = { -1, -1 };
+    // Saved before the move, as promotion replaces the piece
+    move start = (move) { curRank, curFile, board[curRank][curFile]->flag };
 
     // Check for capture
     if(board[targetRank][targetFile] != NULL){
         capturedPos = (move) { targetRank, targetFile, board[targetRank][targetFile]->flag };
         capturedType = board[targetRank][targetFile]->type;
-        printf("Captured %c\n", board[targetRank][targetFile]->rep);
-        free(board[targetRank][targetFile]);
+        releasePiece(board[targetRank][targetFile]);
     }
     // Move piece
     movePiece(board, curRank, curFile, targetRank, targetFile);
@@ -261,7 +518,6 @@ void processMove(piece ***board, int curRank, int curFile, int targetRank, int t
     checkCastle(board, targetRank, targetFile, flag);
 
     // Record move on stack
-    move start = (move) { curRank, curFile, board[targetRank][targetFile]->flag };
     move end = (move) { targetRank, targetFile, flag };
     moveRecords = storeMove(moveRecords, start, end, capturedType, capturedPos, board[targetRank][targetFile]->owner);
 }
@@ -273,34 +529,36 @@ void movePiece(piece ***board, int curRank, int curFile, int tarRank, int tarFil
         updateKing(tarRank, tarFile, board[tarRank][tarFile]->owner);
     }
 }
-// Promotes to piece to a queen if it is an eligible pawn
+// Promotes to piece to the user's choice (or promoteTo, if set) if it is an eligible pawn
 void promotePawn(piece ***board, int rank, int file){
     int owner = board[rank][file]->owner;
     if(board[rank][file]->type == Pawn && ((owner == 0 && rank == 0) || (owner == 1 && rank == BOARD_SIZE - 1))){
-        // Get user's choice of promotion
-        printf("What would you like to promote this pawn to? (Q - Queen | R - Rook | B - Bishop | N - Knight)\n");
-        char input;
-        int isValidInput = 0;
-        piece choice;
-        while(isValidInput == 0){
-            scanf("%c", &input);
-            clearstdin();
-            isValidInput = 1;
-            if(input == 'Q'){
-                choice = pieceTypes[Queen];
-                printf("Pawn promoted to Queen.\n");
-            } else if(input == 'R'){
-                choice = pieceTypes[Rook];
-                printf("Pawn promoted to Rook.\n");
-            } else if(input == 'B'){
-                choice = pieceTypes[Bishop];
-                printf("Pawn promoted to Bishop.\n");
-            } else if(input == 'N'){
-                choice = pieceTypes[Knight];
-                printf("Pawn promoted to Knight.\n");
-            } else {
-                isValidInput = 0;
-                printf("Invalid choice.\n");
+        piece choice = pieceTypes[promoteTo == None ? Queen : promoteTo];
+        if(promoteTo == None){
+            // Get user's choice of promotion
+            printf("What would you like to promote this pawn to? (Q - Queen | R - Rook | B - Bishop | N - Knight)\n");
+            char input;
+            int isValidInput = 0;
+            while(isValidInput == 0){
+                scanf("%c", &input);
+                clearstdin();
+                isValidInput = 1;
+                if(input == 'Q'){
+                    choice = pieceTypes[Queen];
+                    printf("Pawn promoted to Queen.\n");
+                } else if(input == 'R'){
+                    choice = pieceTypes[Rook];
+                    printf("Pawn promoted to Rook.\n");
+                } else if(input == 'B'){
+                    choice = pieceTypes[Bishop];
+                    printf("Pawn promoted to Bishop.\n");
+                } else if(input == 'N'){
+                    choice = pieceTypes[Knight];
+                    printf("Pawn promoted to Knight.\n");
+                } else {
+                    isValidInput = 0;
+                    printf("Invalid choice.\n");
+                }
             }
         }
         addPiece(choice, board, rank, file, owner);
@@ -313,18 +571,21 @@ move checkEnPassant(piece ***board, int rank, int file, int flag){
     int dir = (owner == 1) ? -1 : 1;
     if(board[rank][file]->type == Pawn && flag == ENPASSANTER){
         res = (move) { rank + dir, file, board[rank + dir][file]->flag };
-        free(board[rank + dir][file]);
+        releasePiece(board[rank + dir][file]);
         board[rank + dir][file] = NULL;
 
     }
     return res;
 }
 // Checks for a castle move. If there is one, move the appropriate rook to the king
+// The rook loses its castle flag, as it has now moved
 void checkCastle(piece ***board, int rank, int file, int flag){
     if(board[rank][file]->type == King && flag == CASTLE_LEFT){
         movePiece(board, rank, 0, rank, file + 1);
+        board[rank][file + 1]->flag = 0;
     } else if(board[rank][file]->type == King && flag == CASTLE_RIGHT){
         movePiece(board, rank, BOARD_SIZE - 1, rank, file - 1);
+        board[rank][file - 1]->flag = 0;
     }
 }
 // Updates the saved position of each player's king
@@ -355,22 +616,7 @@ move *getPawnMoves(int rank, int file, piece ***board, int owner, int *cnt){
             addPossibleMove(possibleMoves, cnt, rank + (2 * dir), file, turn);
         }
     }
-    // Capture right
-    if(isEnemyPiece(rank + dir, file + 1, owner, board)){
-        addPossibleMove(possibleMoves, cnt, rank + dir, file + 1, 0);
-    }
-    // Capture left
-    if(isEnemyPiece(rank + dir, file - 1, owner, board)){
-        addPossibleMove(possibleMoves, cnt, rank + dir, file - 1, 0);
-    }
-    // EN PASSANT RIGHT
-    if(isValidTile(rank, file + 1) && board[rank][file + 1] != NULL && board[rank][file + 1]->type == Pawn && turn - board[rank][file + 1]->flag == 1){
-        addPossibleMove(possibleMoves, cnt, rank + dir, file + 1, ENPASSANTER);
-    }
-    // EN PASSANT LEFT
-    if(isValidTile(rank, file - 1) && board[rank][file - 1] != NULL && board[rank][file - 1]->type == Pawn && turn - board[rank][file - 1]->flag == 1){
-        addPossibleMove(possibleMoves, cnt, rank + dir, file - 1, ENPASSANTER);
-    }
+    addPawnCaptures(rank, file, board, owner, cnt, possibleMoves);
     return possibleMoves;
 }
 // Returns all possible moves for a knight to make (and number of possible moves)
@@ -436,7 +682,7 @@ move *getKingMoves(int rank, int file, piece ***board, int owner, int *cnt){
     }
     // Castle right
     if(board[rank][file]->flag == 1 && kingPos[owner].flag == 0 && (turn % 2) == owner
-       && board[rank][0] != NULL && board[rank][BOARD_SIZE - 1]->type == Rook && board[rank][BOARD_SIZE - 1]->flag == 1 && canCastleRow(rank, file, file + 1, BOARD_SIZE - 2, board)){
+       && board[rank][BOARD_SIZE - 1] != NULL && board[rank][BOARD_SIZE - 1]->type == Rook && board[rank][BOARD_SIZE - 1]->flag == 1 && canCastleRow(rank, file, file + 1, BOARD_SIZE - 2, board)){
         addPossibleMove(possibleMoves, cnt, rank, file + 2, CASTLE_RIGHT);
     }
     return possibleMoves;
@@ -487,40 +733,215 @@ void addStraightMoves(int rank, int file, piece ***board, int owner, int *cnt, m
 }
 //}
 
-//{ Game end conditions
-// Returns 1 if the given player is in check
-int isCheck(piece ***board, int rank, int file, int owner){
-    int cnt = 0, flag;
+// Adds all captures for a pawn, including en passant, to an array of possible moves
+void addPawnCaptures(int rank, int file, piece ***board, int owner, int *cnt, move *moves){
+    int dir = (owner == 1) ? 1 : -1;
+    // Captures onto the last rank promote too
+    int captureFlag = (rank + dir == 0 || rank + dir == BOARD_SIZE - 1) ? PROMOTED : 0;
+
+    // Capture right
+    if(isEnemyPiece(rank + dir, file + 1, owner, board)){
+        addPossibleMove(moves, cnt, rank + dir, file + 1, captureFlag);
+    }
+    // Capture left
+    if(isEnemyPiece(rank + dir, file - 1, owner, board)){
+        addPossibleMove(moves, cnt, rank + dir, file - 1, captureFlag);
+    }
+    // EN PASSANT RIGHT
+    if(isEnemyPiece(rank, file + 1, owner, board) && board[rank][file + 1]->type == Pawn && turn - board[rank][file + 1]->flag == 1){
+        addPossibleMove(moves, cnt, rank + dir, file + 1, ENPASSANTER);
+    }
+    // EN PASSANT LEFT
+    if(isEnemyPiece(rank, file - 1, owner, board) && board[rank][file - 1]->type == Pawn && turn - board[rank][file - 1]->flag == 1){
+        addPossibleMove(moves, cnt, rank + dir, file - 1, ENPASSANTER);
+    }
+}
+// Adds the captures (and en passants) that the piece's getPossibleMoves would find to an array of possible moves
+// Unlike getPossibleMoves this allocates nothing and skips quiet moves entirely
+void addCaptureMoves(int rank, int file, piece ***board, int owner, int *cnt, move *moves){
+    static const int rankDirs[] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+    static const int fileDirs[] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+    Type type = board[rank][file]->type;
+    if(type == Pawn){
+        addPawnCaptures(rank, file, board, owner, cnt, moves);
+    } else if(type == Knight){
+        for(int k = 0; k < 2; k++){
+            for(int i = 0; i < 2; i++){
+                for(int j = 0; j < 2; j++){
+                    int tarRank = rank + (2 - k) * (1 - (2 * i));
+                    int tarFile = file + (1 + k) * (1 - (2 * j));
+                    if(isEnemyPiece(tarRank, tarFile, owner, board)){
+                        addPossibleMove(moves, cnt, tarRank, tarFile, 0);
+                    }
+                }
+            }
+        }
+    } else if(type == King){
+        for(int i = rank - 1; i <= rank + 1; i++){
+            for(int j = file - 1; j <= file + 1; j++){
+                if(isEnemyPiece(i, j, owner, board)){
+                    addPossibleMove(moves, cnt, i, j, 0);
+                }
+            }
+        }
+    } else {
+        // Directions 0-3 are straight and 4-7 are diagonal. A slider can capture the first piece in each direction
+        int first = (type == Bishop) ? 4 : 0, last = (type == Rook) ? 4 : 8;
+        for(int d = first; d < last; d++){
+            int tarRank = rank + rankDirs[d], tarFile = file + fileDirs[d];
+            while(isValidEmpty(tarRank, tarFile, board)){
+                tarRank += rankDirs[d];
+                tarFile += fileDirs[d];
+            }
+            if(isEnemyPiece(tarRank, tarFile, owner, board)){
+                addPossibleMove(moves, cnt, tarRank, tarFile, 0);
+            }
+        }
+    }
+}
+//}
+
+//{ Staged move generation
+// Prepares a generator for the player's moves. Nothing is generated until nextMove is called
+// Moves are pseudo-legal, as with getPossibleMoves. With capturesOnly, only the capture stage is generated
+void startMoveGen(moveGen *gen, piece ***board, int owner, int capturesOnly){
+    gen->board = board;
+    gen->owner = owner;
+    gen->capturesOnly = capturesOnly;
+    gen->stage = GenStart;
+    gen->cnt = 0;
+    gen->next = 0;
+    gen->quietCnt = 0;
+    gen->checksFirst = 1;
+}
+// Gets the next move: captures (most valuable victim, then least valuable attacker), promotions, quiet moves
+// that give check, then the remaining quiet moves. Returns 0 once there are no moves left
+int nextMove(moveGen *gen, legalMove *mv){
+    while(1){
+        if(gen->next < gen->cnt){
+            *mv = gen->moves[gen->next++];
+            // Quiet moves are checked for check one at a time, so callers that stop early don't pay for the rest
+            if(gen->stage == GenChecks && !isSimulatedCheck(gen->board, mv->start.rank, mv->start.file,
+                                                            mv->end.rank, mv->end.file, (gen->owner + 1) % 2)){
+                gen->quiet[gen->quietCnt++] = *mv;
+                continue;
+            }
+            return 1;
+        }
+        if(gen->stage == GenDone || (gen->capturesOnly && gen->stage == GenCaptures)){
+            gen->stage = GenDone;
+            return 0;
+        }
+
+        // Move on to the next stage
+        gen->stage++;
+        gen->cnt = 0;
+        gen->next = 0;
+        if(gen->stage == GenCaptures){
+            genCaptures(gen);
+        } else if(gen->stage == GenPromotions){
+            genPromotions(gen);
+        } else if(gen->stage == GenChecks){
+            genQuietMoves(gen);
+            // Without check ordering the quiet moves are handed out as they are
+            if(!gen->checksFirst){
+                gen->stage = GenQuiet;
+            }
+        } else if(gen->stage == GenQuiet){
+            memcpy(gen->moves, gen->quiet, gen->quietCnt * sizeof(legalMove));
+            gen->cnt = gen->quietCnt;
+        }
+    }
+}
+// Adds a move to the current stage, once for each promotion choice if it promotes
+void addStageMove(moveGen *gen, move start, move end, Type promo){
+    if(end.flag != PROMOTED){
+        gen->moves[gen->cnt++] = (legalMove) { start, end, promo };
+        return;
+    }
+    for(Type t = Queen; t >= Knight; t--){
+        gen->moves[gen->cnt++] = (legalMove) { start, end, t };
+    }
+}
+// Generates all captures and sorts them by captureScore
+void genCaptures(moveGen *gen){
+    move captures[MAX_MOVES];
     for(int i = 0; i < BOARD_SIZE; i++){
         for(int j = 0; j < BOARD_SIZE; j++){
-            if(isEnemyPiece(i, j, owner, board)){
-                move *possibleMoves = board[i][j]->getPossibleMoves(i, j, board, (owner + 1) % 2, &cnt);
-                if(isPossibleMove(rank, file, possibleMoves, cnt, &flag)){
-                    free(possibleMoves);
-                    return 1;
-                }
-                free(possibleMoves);
+            if(!isAllyPiece(i, j, gen->owner, gen->board)){
+                continue;
+            }
+            int cnt = 0;
+            addCaptureMoves(i, j, gen->board, gen->owner, &cnt, captures);
+            for(int k = 0; k < cnt; k++){
+                addStageMove(gen, (move) { i, j, 0 }, captures[k], None);
             }
         }
     }
-    return 0;
+    // Insertion sort, as there are only ever a handful of captures
+    for(int i = 1; i < gen->cnt; i++){
+        legalMove mv = gen->moves[i];
+        int score = captureScore(gen->board, mv), j = i;
+        while(j > 0 && captureScore(gen->board, gen->moves[j - 1]) < score){
+            gen->moves[j] = gen->moves[j - 1];
+            j--;
+        }
+        gen->moves[j] = mv;
+    }
 }
-// Returns 1 if the specified king has a valid move
-int hasLegalKingMove(int rank, int file, piece ***board, int owner){
-    for(int i = rank - 1; i <= rank + 1; i++){
-        for(int j = file - 1; j <= file + 1; j++){
-            if(i == rank && j == file){
+// Generates pawn moves forward onto the last rank
+void genPromotions(moveGen *gen){
+    int dir = (gen->owner == 1) ? 1 : -1;
+    int rank = (gen->owner == 1) ? BOARD_SIZE - 2 : 1;
+    for(int j = 0; j < BOARD_SIZE; j++){
+        piece *p = gen->board[rank][j];
+        if(p != NULL && p->owner == gen->owner && p->type == Pawn && gen->board[rank + dir][j] == NULL){
+            addStageMove(gen, (move) { rank, j, 0 }, (move) { rank + dir, j, PROMOTED }, None);
+        }
+    }
+}
+// Generates every move that isn't a capture or promotion, for the check and quiet stages to share
+void genQuietMoves(moveGen *gen){
+    int cnt;
+    for(int i = 0; i < BOARD_SIZE; i++){
+        for(int j = 0; j < BOARD_SIZE; j++){
+            if(!isAllyPiece(i, j, gen->owner, gen->board)){
                 continue;
             }
-            // King can move to empty space or capture, but only if that move wouldn't be in check.
-            if((isValidEmpty(i, j, board) || isEnemyPiece(i, j, owner, board)) && !isSimulatedCheck(board, rank, file, i, j, owner)){
-                return 1;
+            move *possibleMoves = gen->board[i][j]->getPossibleMoves(i, j, gen->board, gen->owner, &cnt);
+            for(int k = 0; k < cnt; k++){
+                move end = possibleMoves[k];
+                if(gen->board[end.rank][end.file] == NULL && end.flag != ENPASSANTER && end.flag != PROMOTED){
+                    gen->moves[gen->cnt++] = (legalMove) { { i, j, 0 }, end, None };
+                }
             }
+            free(possibleMoves);
         }
     }
-    return 0;
 }
+// Scores a capture by the victim first, then the cheapest attacker, then the promotion choice
+int captureScore(piece ***board, legalMove mv){
+    piece *victim = board[mv.end.rank][mv.end.file];
+    Type victimType = (victim == NULL) ? Pawn : victim->type; // En passant
+    Type attacker = board[mv.start.rank][mv.start.file]->type;
+    return (victimType * BOARD_SIZE + (King - attacker)) * BOARD_SIZE + (mv.promo == None ? 0 : mv.promo);
+}
+//}
 
+//{ Game end conditions
+// Returns 1 if the given player is in check
+// Only the enemy's captures are generated, and the king comes first as the most valuable victim
+int isCheck(piece ***board, int rank, int file, int owner){
+    moveGen gen;
+    legalMove mv;
+    startMoveGen(&gen, board, (owner + 1) % 2, 1);
+    while(nextMove(&gen, &mv)){
+        if(mv.end.rank == rank && mv.end.file == file){
+            return 1;
+        }
+    }
+    return 0;
+}
 // TODO: use move piece for this instead
 // Returns 1 if the piece at (curRank, curFile) would be in check if it were moved to (tarRank, tarFile)
 int isSimulatedCheck(piece ***board, int curRank, int curFile, int tarRank, int tarFile, int owner){
@@ -530,6 +951,12 @@ int isSimulatedCheck(piece ***board, int curRank, int curFile, int tarRank, int
         tmp = board[tarRank][tarFile];
         board[tarRank][tarFile] = NULL;
     }
+    // A pawn moving diagonally onto an empty tile takes en passant, so lift the pawn it passes
+    piece *passant = NULL;
+    if(board[curRank][curFile]->type == Pawn && curFile != tarFile && tmp == NULL){
+        passant = board[curRank][tarFile];
+        board[curRank][tarFile] = NULL;
+    }
     // Move piece
     movePiece(board, curRank, curFile, tarRank, tarFile);
     // Get result
@@ -539,33 +966,81 @@ int isSimulatedCheck(piece ***board, int curRank, int curFile, int tarRank, int
     if(tmp != NULL){
         board[tarRank][tarFile] = tmp;
     }
+    if(passant != NULL){
+        board[curRank][tarFile] = passant;
+    }
     return res;
 }
 // Returns 1 if the specified player has no legal moves and 0 otherwise
-// Assumes the owner's king is not in check
+// Stops at the first legal move found. Assumes the player is to move and their check status has been cached
 int isStalemate(piece ***board, int owner){
-    int cnt = 0;
-    for(int i = 0; i < BOARD_SIZE; i++){
-        for(int j = 0; j < BOARD_SIZE; j++){
-            // Check if non-king ally can move
-            if(isAllyPiece(i, j, owner, board) && board[i][j]->type != King){
-                move *possibleMoves = board[i][j]->getPossibleMoves(i, j, board, owner, &cnt);
-                // A possible move can still be invalid if it would put the king in check
-                for(int k = 0; k < cnt; k++){
-                    int tarRank = possibleMoves[k].rank, tarFile = possibleMoves[k].file;
-                    if(!isSimulatedCheck(board, i, j, tarRank, tarFile, owner)){
-                        free(possibleMoves);
-                        return 0;
-                    }
+    moveGen gen;
+    legalMove mv;
+    Type saved = promoteTo;
+    int res = 1;
+    startMoveGen(&gen, board, owner, 0);
+    // Any legal move will do, so don't spend time finding checks first
+    gen.checksFirst = 0;
+    // Moves are played through makeMove, so en passant captures and castling are judged as in the game
+    while(res && nextMove(&gen, &mv)){
+        promoteTo = (mv.promo == None) ? Queen : mv.promo;
+        if(makeMove(board, mv.start, mv.end)){
+            moveRecords = undoMove(moveRecords, board);
+            res = 0;
+        }
+    }
+    promoteTo = saved;
+    return res;
+}
+// Fills moves with up to max legal moves for the player to move, with one move per promotion choice
+// Assumes the player's check status has been cached. Returns the number of moves found
+int getLegalMoves(piece ***board, int owner, legalMove *moves, int max){
+    int cnt = 0, legal = 0;
+    promoteTo = Queen;
+    for(int i = 0; i < BOARD_SIZE && legal < max; i++){
+        for(int j = 0; j < BOARD_SIZE && legal < max; j++){
+            if(!isAllyPiece(i, j, owner, board)){
+                continue;
+            }
+            move *possibleMoves = board[i][j]->getPossibleMoves(i, j, board, owner, &cnt);
+            for(int k = 0; k < cnt && legal < max; k++){
+                if(!makeMove(board, (move) { i, j, 0 }, possibleMoves[k])){
+                    continue;
+                }
+                moveRecords = undoMove(moveRecords, board);
+                if(possibleMoves[k].flag != PROMOTED){
+                    moves[legal++] = (legalMove) { { i, j, 0 }, possibleMoves[k], None };
+                    continue;
+                }
+                for(Type t = Queen; t >= Knight && legal < max; t--){
+                    moves[legal++] = (legalMove) { { i, j, 0 }, possibleMoves[k], t };
                 }
-                free(possibleMoves);
-            // Check if ally king has legal moves
-            } else if(isAllyPiece(i, j, owner, board) && hasLegalKingMove(i, j, board, owner)){
-                return 0;
             }
+            free(possibleMoves);
         }
     }
-    return 1;
+    return legal;
+}
+// Like getLegalMoves, but in the staged generator's order: captures, promotions, checks, then quiet moves
+int getOrderedMoves(piece ***board, int owner, legalMove *moves, int max){
+    moveGen gen;
+    legalMove mv;
+    int legal = 0;
+    startMoveGen(&gen, board, owner, 0);
+    while(legal < max && nextMove(&gen, &mv)){
+        promoteTo = (mv.promo == None) ? Queen : mv.promo;
+        if(makeMove(board, mv.start, mv.end)){
+            moveRecords = undoMove(moveRecords, board);
+            moves[legal++] = mv;
+        }
+    }
+    return legal;
+}
+// Returns the number of legal moves for the player to move, counting each promotion choice separately
+// Assumes the player's check status has been cached
+int countLegalMoves(piece ***board, int owner){
+    legalMove moves[MAX_LEGAL];
+    return getLegalMoves(board, owner, moves, MAX_LEGAL);
 }
 //}
 
@@ -594,14 +1069,14 @@ int isValidEmpty(int rank, int file, piece ***board){
     return(isValidTile(rank, file) && board[rank][file] == NULL);
 }
 // Checks if all tiles from startFile to endFile (inclusive) on specified rank are clear
-// Also checks if all tiles in the same interval are not in check if the piece at (rank, file) were to be moved there
+// Also checks that the tiles the piece at (rank, file) passes through when castling would not be in check
 // Assumes the king's flag is 1, meaning the king is eligible for castling
 int canCastleRow(int rank, int file, int startFile, int endFile, piece ***board){
     // Temporarily turn king's flag to 0 to prevent infinite loops
     piece *king = board[rank][file];
     king->flag = 0;
     for(int i = startFile; i <= endFile; i++){
-        if(!isValidEmpty(rank, i, board) && !isSimulatedCheck(board, rank, file, rank, i, king->owner)){
+        if(!isValidEmpty(rank, i, board) || (abs(i - file) <= 2 && isSimulatedCheck(board, rank, file, rank, i, king->owner))){
             king->flag = 1;
             return 0;
         }
@@ -663,19 +1138,150 @@ void readyBoard( piece ***board){
     addPiece(pieceTypes[Knight], board, 0, 6, 1);
     addPiece(pieceTypes[Rook], board, 0, 7, 1);
 }
+// Sets up a board from the first four fields of a FEN or EPD record. Returns 1 if the record was valid
+int loadFen(piece ***board, const char *fen){
+    clearBoard(board);
+    freeMoves(moveRecords);
+    moveRecords = NULL;
+
+    // Piece placement, from the 8th rank down
+    int rank = 0, file = 0, kings[2] = { 0 };
+    const char *c = fen;
+    while(*c == ' '){
+        c++;
+    }
+    for(; *c != '\0' && *c != ' '; c++){
+        if(*c == '/'){
+            if(file != BOARD_SIZE || ++rank >= BOARD_SIZE){
+                return 0;
+            }
+            file = 0;
+        } else if(*c >= '1' && *c <= '8'){
+            file += *c - '0';
+        } else {
+            Type type = pieceType(*c);
+            if(type == None || file >= BOARD_SIZE){
+                return 0;
+            }
+            int owner = (*c >= 'a');
+            addPiece(pieceTypes[type], board, rank, file, owner);
+            // Castling rights are given back below
+            board[rank][file]->flag = 0;
+            if(type == King){
+                updateKing(rank, file, owner);
+                kings[owner]++;
+            }
+            file++;
+        }
+        if(file > BOARD_SIZE){
+            return 0;
+        }
+    }
+    if(rank != BOARD_SIZE - 1 || file != BOARD_SIZE || kings[0] != 1 || kings[1] != 1){
+        return 0;
+    }
+
+    // Side to move. Turn starts at 2 so that pawns with a flag of 0 never look like they just moved two tiles
+    char side, castle[5], passant[3];
+    if(sscanf(c, " %c %4s %2s", &side, castle, passant) != 3 || (side != 'w' && side != 'b')){
+        return 0;
+    }
+    turn = 2 + (side == 'b');
+
+    // Castling rights are stored as the flags of the king and rook
+    for(char *r = castle; *r != '\0' && *r != '-'; r++){
+        int owner = (*r >= 'a'), row = (owner == 1) ? 0 : BOARD_SIZE - 1;
+        int rookFile = (*r == 'K' || *r == 'k') ? BOARD_SIZE - 1 : 0;
+        if(pieceType(*r) != King && pieceType(*r) != Queen){
+            return 0;
+        }
+        piece *king = board[row][4], *rook = board[row][rookFile];
+        if(king != NULL && king->type == King && king->owner == owner && rook != NULL && rook->type == Rook && rook->owner == owner){
+            king->flag = CAN_CASTLE;
+            rook->flag = CAN_CASTLE;
+        }
+    }
+    // En passant is stored as the flag of the pawn that moved two tiles on the previous turn
+    if(passant[0] != '-'){
+        int pawnRank = BOARD_SIZE - (passant[1] - '0') + ((side == 'w') ? 1 : -1), pawnFile = passant[0] - 'a';
+        if(isValidTile(pawnRank, pawnFile) && board[pawnRank][pawnFile] != NULL && board[pawnRank][pawnFile]->type == Pawn){
+            board[pawnRank][pawnFile]->flag = turn - 1;
+        }
+    }
+    return 1;
+}
+// Returns the type of piece for a letter of either case, or None
+Type pieceType(char rep){
+    for(Type t = Pawn; t < None; t++){
+        if(rep == pieceTypes[t].rep || rep == pieceTypes[t].rep + UPPER){
+            return t;
+        }
+    }
+    return None;
+}
 //}
 
 //{ Memory management
-// Frees a board, including all pieces on the board
+// Removes all pieces from a board
+void clearBoard(piece ***board){
+    for(int i = 0; i < BOARD_SIZE; i++){
+        for(int j = 0; j < BOARD_SIZE; j++){
+            releasePiece(board[i][j]);
+            board[i][j] = NULL;
+        }
+    }
+}
+// Frees a board. Its pieces go back to the piece pool
 void freeBoard(piece ***board){
     for(int i = 0; i < BOARD_SIZE; i++){
         for(int j = 0; j < BOARD_SIZE; j++){
-            free(board[i][j]);
+            releasePiece(board[i][j]);
         }
         free(board[i]);
     }
     free(board);
 }
+// Gets a piece from this thread's pool, only allocating when the pool is empty
+// Pieces are captured and restored constantly during searches, so this keeps them off the heap
+piece *newPiece(){
+    if(piecePool == NULL){
+        return malloc(sizeof(piece));
+    }
+    piece *p = piecePool;
+    piecePool = p->next;
+    return p;
+}
+// Returns a piece to this thread's pool
+void releasePiece(piece *p){
+    if(p != NULL){
+        p->next = piecePool;
+        piecePool = p;
+    }
+}
+// Gets a move record from this thread's pool, only allocating when the pool is empty
+moveRecord *newRecord(){
+    if(recordPool == NULL){
+        return malloc(sizeof(moveRecord));
+    }
+    moveRecord *rec = recordPool;
+    recordPool = rec->next;
+    return rec;
+}
+// Frees this thread's pools. Call before a thread that used a board exits
+void freePools(){
+    while(piecePool != NULL){
+        piece *next = piecePool->next;
+        free(piecePool);
+        piecePool = next;
+    }
+    freeMoves(moveRecords);
+    moveRecords = NULL;
+    while(recordPool != NULL){
+        moveRecord *next = recordPool->next;
+        free(recordPool);
+        recordPool = next;
+    }
+}
 //}
 
 //{ Input/Output
@@ -747,7 +1353,7 @@ void printBoard(piece ***board){
 //{ Move history
 // Adds a move record to the stack of all moves played in the game
 moveRecord *storeMove(moveRecord *head, move start, move end, Type captured, move capturedPos, int owner){
-    moveRecord *rec = malloc(sizeof(moveRecord));
+    moveRecord *rec = newRecord();
     rec->start = start;
     rec->end = end;
     rec->captured = captured;
@@ -770,11 +1376,14 @@ moveRecord *undoMove(moveRecord *head, piece ***board){
         addPiece(pieceTypes[Pawn], board, rec->start.rank, rec->start.file, rec->player);
     }
 
-    // Undo castling
-    if(rec->end.flag == CASTLE_LEFT){
+    // Undo castling. Pawn flags hold turn numbers, so only a king's flag can mean a castle
+    int isKing = board[rec->start.rank][rec->start.file]->type == King;
+    if(isKing && rec->end.flag == CASTLE_LEFT){
         movePiece(board, rec->end.rank, rec->end.file + 1, rec->end.rank, 0);
-    } else if(rec->end.flag == CASTLE_RIGHT){
+        board[rec->end.rank][0]->flag = CAN_CASTLE;
+    } else if(isKing && rec->end.flag == CASTLE_RIGHT){
         movePiece(board, rec->end.rank, rec->end.file - 1, rec->end.rank, BOARD_SIZE - 1);
+        board[rec->end.rank][BOARD_SIZE - 1]->flag = CAN_CASTLE;
     }
     // Reset flags
     board[rec->start.rank][rec->start.file]->flag = rec->start.flag;
@@ -788,7 +1397,1007 @@ moveRecord *undoMove(moveRecord *head, piece ***board){
 
     // Remove record from stack
     head = rec->next;
-    free(rec);
+    rec->next = recordPool;
+    recordPool = rec;
     return head;
 }
+// Drops a stack of move records without undoing them, returning them to the pool
+void freeMoves(moveRecord *head){
+    while(head != NULL){
+        moveRecord *next = head->next;
+        head->next = recordPool;
+        recordPool = head;
+        head = next;
+    }
+}
+//}
+
+//{ Position snapshots
+// Copies the board, turn and king positions into a snapshot
+void savePosition(piece ***board, position *pos){
+    for(int i = 0; i < BOARD_SIZE; i++){
+        for(int j = 0; j < BOARD_SIZE; j++){
+            piece *p = board[i][j];
+            pos->squares[i][j] = (p == NULL) ? (square) { None, 0, 0 } : (square) { p->type, p->owner, p->flag };
+        }
+    }
+    pos->turn = turn;
+    memcpy(pos->kingPos, kingPos, sizeof(kingPos));
+}
+// Sets the board, turn and king positions from a snapshot, reusing the board's pieces where it can
+// The move history is left alone, so undoMove must not be used past a loaded position
+void loadPosition(piece ***board, const position *pos){
+    for(int i = 0; i < BOARD_SIZE; i++){
+        for(int j = 0; j < BOARD_SIZE; j++){
+            const square *sq = &pos->squares[i][j];
+            if(sq->type == None){
+                releasePiece(board[i][j]);
+                board[i][j] = NULL;
+                continue;
+            }
+            if(board[i][j] == NULL){
+                board[i][j] = newPiece();
+            }
+            *board[i][j] = pieceTypes[sq->type];
+            board[i][j]->owner = sq->owner;
+            board[i][j]->flag = sq->flag;
+        }
+    }
+    turn = pos->turn;
+    memcpy(kingPos, pos->kingPos, sizeof(kingPos));
+}
+// Copy-make: saves the position, then plays a generated move without adding it to the move history
+// Returns 1 if the move was legal, in which case loadPosition(board, saved) takes it back
+// An illegal move is taken back straight away
+int copyMake(piece ***board, position *saved, legalMove mv){
+    savePosition(board, saved);
+    promoteTo = (mv.promo == None) ? Queen : mv.promo;
+    if(!makeMove(board, mv.start, mv.end)){
+        return 0;
+    }
+    // The snapshot replaces the record, so drop it
+    moveRecord *rec = moveRecords;
+    moveRecords = rec->next;
+    rec->next = NULL;
+    freeMoves(rec);
+    return 1;
+}
+//}
+
+//{ Game database
+// Fills the Zobrist tables used to key positions. Must run before any thread hashes a position
+void initZobrist(){
+    // Fixed seed, so keys are the same on every run and every machine
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t *tables[] = { &zobrist[0][0][0], zobristCastle, zobristPassant, &zobristTurn };
+    size_t sizes[] = { sizeof(zobrist), sizeof(zobristCastle), sizeof(zobristPassant), sizeof(zobristTurn) };
+    for(int t = 0; t < 4; t++){
+        for(size_t i = 0; i < sizes[t] / sizeof(uint64_t); i++){
+            tables[t][i] = splitmix(&seed);
+        }
+    }
+}
+// Returns the next number from a splitmix64 generator
+uint64_t splitmix(uint64_t *state){
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+// Returns the Zobrist key of a position, including side to move, castling rights and en passant
+uint64_t positionKey(piece ***board){
+    uint64_t key = (turn % 2) ? zobristTurn : 0;
+    for(int i = 0; i < BOARD_SIZE; i++){
+        for(int j = 0; j < BOARD_SIZE; j++){
+            piece *p = board[i][j];
+            if(p == NULL){
+                continue;
+            }
+            int sq = i * BOARD_SIZE + j;
+            key ^= zobrist[p->owner][p->type][sq];
+            // En passant only counts when an enemy pawn beside the pawn that just moved two tiles can take it,
+            // so transpositions that differ only by a double step get the same key
+            if(p->type == Pawn && turn - p->flag == 1 && i == (p->owner == 0 ? BOARD_SIZE - 4 : 3)
+               && ((isEnemyPiece(i, j - 1, p->owner, board) && board[i][j - 1]->type == Pawn)
+                   || (isEnemyPiece(i, j + 1, p->owner, board) && board[i][j + 1]->type == Pawn))){
+                key ^= zobristPassant[j];
+            }
+        }
+    }
+    // A castling right only counts while the king and that side's rook are both unmoved on their home tiles
+    for(int owner = 0; owner < 2; owner++){
+        int rank = (owner == 0) ? BOARD_SIZE - 1 : 0;
+        piece *king = board[rank][4];
+        if(king == NULL || king->type != King || king->owner != owner || king->flag != CAN_CASTLE){
+            continue;
+        }
+        for(int file = 0; file < BOARD_SIZE; file += BOARD_SIZE - 1){
+            piece *rook = board[rank][file];
+            if(rook != NULL && rook->type == Rook && rook->owner == owner && rook->flag == CAN_CASTLE){
+                key ^= zobristCastle[rank * BOARD_SIZE + file];
+            }
+        }
+    }
+    return key;
+}
+// Parses a move in coordinate notation (e.g. e2e4 or e7e8n) from at most len characters
+// Returns the number of characters used, or 0 if there is no valid move
+int parseMove(const char *str, size_t len, move *cur, move *tar, Type *promo){
+    if(len < 4 || str[0] < 'a' || str[0] > 'h' || str[1] < '1' || str[1] > '8'
+       || str[2] < 'a' || str[2] > 'h' || str[3] < '1' || str[3] > '8'){
+        return 0;
+    }
+    *cur = (move) { BOARD_SIZE - (str[1] - '0'), str[0] - 'a', 0 };
+    *tar = (move) { BOARD_SIZE - (str[3] - '0'), str[2] - 'a', 0 };
+    *promo = (len > 4) ? pieceType(str[4]) : None;
+    if(*promo < Knight || *promo > Queen){
+        *promo = None;
+        return 4;
+    }
+    return 5;
+}
+// Packs a move into 16 bits: start tile, target tile and promotion type
+uint16_t encodeMove(move cur, move tar, Type promo){
+    int promoBits = (promo == None) ? 0 : promo;
+    return (cur.rank * BOARD_SIZE + cur.file) | ((tar.rank * BOARD_SIZE + tar.file) << 6) | (promoBits << 12);
+}
+// Prints a packed move in coordinate notation
+void printEncodedMove(uint16_t code){
+    if(code == NO_NEXT_MOVE){
+        printf("(end)");
+        return;
+    }
+    int start = code & 63, end = (code >> 6) & 63, promo = code >> 12;
+    printf("%c%d%c%d", 'a' + start % BOARD_SIZE, BOARD_SIZE - start / BOARD_SIZE, 'a' + end % BOARD_SIZE, BOARD_SIZE - end / BOARD_SIZE);
+    if(promo != 0){
+        printf("%c", pieceTypes[promo].rep + UPPER);
+    }
+}
+// Replays games handed out by the job until there are none left, collecting an entry per position
+void *runIndexWorker(void *arg){
+    indexWorker *worker = arg;
+    indexJob *job = worker->job;
+    piece ***board = makeBoard();
+    uint32_t game;
+    while((game = atomic_fetch_add(&job->nextGame, 1)) < job->gameCount){
+        const char *text = job->games + job->gameOffsets[game];
+        const char *end = memchr(text, '\n', job->size - job->gameOffsets[game]);
+        if(end == NULL){
+            end = job->games + job->size;
+        }
+        if(!indexGame(board, text, end, game, worker)){
+            worker->badGames++;
+        }
+    }
+    freeBoard(board);
+    freePools();
+
+    // Sort this worker's run here so the sorts run in parallel and buildIndex only has to merge
+    if(worker->cnt > 0){
+        qsort(worker->entries, worker->cnt, sizeof(indexEntry), compareEntries);
+    }
+    return NULL;
+}
+// Replays one game from the starting position. Returns 0 if the game has an unreadable or illegal move
+// Positions up to the bad move are still indexed
+int indexGame(piece ***board, const char *text, const char *end, uint32_t game, indexWorker *worker){
+    clearBoard(board);
+    freeMoves(moveRecords);
+    moveRecords = NULL;
+    turn = 0;
+    readyBoard(board);
+
+    for(uint16_t ply = 0; ; ply++){
+        while(text < end && (*text == ' ' || *text == '\t' || *text == '\r')){
+            text++;
+        }
+        uint64_t key = positionKey(board);
+        if(text == end){
+            addIndexEntry(worker, key, game, ply, NO_NEXT_MOVE);
+            return 1;
+        }
+        move cur, tar;
+        Type promo;
+        int len = parseMove(text, end - text, &cur, &tar, &promo);
+        promoteTo = (promo == None) ? Queen : promo;
+        cacheCheck(board, turn % 2);
+        if(len == 0 || ply == NO_NEXT_MOVE - 1 || !tryMove(board, cur, tar)){
+            addIndexEntry(worker, key, game, ply, NO_NEXT_MOVE);
+            return 0;
+        }
+        // Only record a promotion the move actually made, so e2e4q is stored as e2e4
+        promo = (moveRecords->end.flag == PROMOTED) ? promoteTo : None;
+        addIndexEntry(worker, key, game, ply, encodeMove(cur, tar, promo));
+        text += len;
+    }
+}
+// Appends an entry to a worker's list of positions
+void addIndexEntry(indexWorker *worker, uint64_t key, uint32_t game, uint16_t ply, uint16_t next){
+    if(worker->cnt == worker->cap){
+        size_t cap = worker->cap ? worker->cap * 2 : 1024;
+        indexEntry *entries = realloc(worker->entries, cap * sizeof(indexEntry));
+        if(entries == NULL){
+            worker->outOfMemory = 1;
+            return;
+        }
+        worker->entries = entries;
+        worker->cap = cap;
+    }
+    worker->entries[worker->cnt++] = (indexEntry) { key, game, ply, next };
+}
+// Orders entries by key, then by game and ply
+int compareEntries(const void *a, const void *b){
+    const indexEntry *x = a, *y = b;
+    if(x->key != y->key){
+        return x->key < y->key ? -1 : 1;
+    }
+    if(x->game != y->game){
+        return x->game < y->game ? -1 : 1;
+    }
+    return (int)x->ply - (int)y->ply;
+}
+// Writes the workers' sorted runs to out as one sorted list. Returns 0 on success
+// Entries go straight from the runs to the file, so no second copy of the index is held in memory
+int writeMergedRuns(FILE *out, indexWorker *workers, int threads){
+    size_t pos[MAX_THREADS] = { 0 };
+    for(;;){
+        int best = -1;
+        for(int i = 0; i < threads; i++){
+            if(pos[i] < workers[i].cnt && (best < 0
+               || compareEntries(&workers[i].entries[pos[i]], &workers[best].entries[pos[best]]) < 0)){
+                best = i;
+            }
+        }
+        if(best < 0){
+            return 0;
+        }
+        if(fwrite(&workers[best].entries[pos[best]++], sizeof(indexEntry), 1, out) != 1){
+            return 1;
+        }
+    }
+}
+// Builds a position index for a file of games (one game per line in coordinate notation)
+// Games are replayed on several threads and the sorted entries are written to indexPath. Returns 0 on success
+int buildIndex(const char *gamePath, const char *indexPath, int threads){
+    size_t size;
+    const char *games = mapFile(gamePath, &size);
+    if(games == NULL){
+        printf("Could not read %s\n", gamePath);
+        return 1;
+    }
+
+    // Find where each game starts, skipping blank lines and # comments
+    indexJob job = { games, size, NULL, 0 };
+    atomic_init(&job.nextGame, 0);
+    uint64_t *offsets = NULL;
+    size_t cap = 0;
+    for(size_t pos = 0; pos < size; ){
+        const char *end = memchr(games + pos, '\n', size - pos);
+        size_t next = (end == NULL) ? size : (size_t)(end - games) + 1;
+        size_t first = pos;
+        while(first < next && (games[first] == ' ' || games[first] == '\t' || games[first] == '\r')){
+            first++;
+        }
+        if(first < next && games[first] != '\n' && games[first] != '#'){
+            if(job.gameCount == cap){
+                cap = cap ? cap * 2 : 1024;
+                uint64_t *grown = realloc(offsets, cap * sizeof(uint64_t));
+                if(grown == NULL){
+                    printf("Out of memory reading %s\n", gamePath);
+                    free(offsets);
+                    unmapFile(games, size);
+                    return 1;
+                }
+                offsets = grown;
+            }
+            offsets[job.gameCount++] = first;
+        }
+        pos = next;
+    }
+    job.gameOffsets = offsets;
+
+    // Replay games in parallel, each thread with its own board
+    if(threads < 1 || threads > MAX_THREADS){
+        threads = numCores();
+    }
+    indexWorker workers[MAX_THREADS] = { { 0 } };
+    for(int i = 0; i < threads; i++){
+        workers[i].job = &job;
+        workers[i].started = pthread_create(&workers[i].thread, NULL, runIndexWorker, &workers[i]) == 0;
+    }
+    // Any worker that could not get a thread does its share here instead
+    for(int i = 0; i < threads; i++){
+        if(!workers[i].started){
+            runIndexWorker(&workers[i]);
+        }
+    }
+    size_t total = 0;
+    uint32_t badGames = 0;
+    int outOfMemory = 0;
+    for(int i = 0; i < threads; i++){
+        if(workers[i].started){
+            pthread_join(workers[i].thread, NULL);
+        }
+        total += workers[i].cnt;
+        badGames += workers[i].badGames;
+        outOfMemory |= workers[i].outOfMemory;
+    }
+
+    // Merge the sorted runs so lookups can binary search the mapped file
+    int res = 1;
+    FILE *out = outOfMemory ? NULL : fopen(indexPath, "wb");
+    if(out != NULL){
+        indexHeader header = { INDEX_MAGIC, INDEX_VERSION, job.gameCount, 0, total };
+        res = fwrite(&header, sizeof(header), 1, out) != 1
+              || fwrite(offsets, sizeof(uint64_t), job.gameCount, out) != job.gameCount
+              || writeMergedRuns(out, workers, threads) != 0;
+        res |= fclose(out) != 0;
+    }
+    if(res == 0){
+        printf("Indexed %u games (%zu positions, %u with illegal moves) to %s using %d threads\n",
+               job.gameCount, total, badGames, indexPath, threads);
+    } else if(outOfMemory){
+        printf("Out of memory indexing %s\n", gamePath);
+    } else {
+        printf("Could not write %s\n", indexPath);
+    }
+    for(int i = 0; i < threads; i++){
+        free(workers[i].entries);
+    }
+    free(offsets);
+    unmapFile(games, size);
+    return res;
+}
+// Maps an index file written by buildIndex. Returns 0 on success
+int openIndex(const char *indexPath, gameIndex *index){
+    index->map = mapFile(indexPath, &index->size);
+    if(index->map == NULL){
+        return 1;
+    }
+    index->header = index->map;
+    if(index->size < sizeof(indexHeader) || memcmp(index->header->magic, INDEX_MAGIC, 4) != 0
+       || index->header->version != INDEX_VERSION
+       || index->size != sizeof(indexHeader) + index->header->gameCount * sizeof(uint64_t)
+                         + index->header->entryCount * sizeof(indexEntry)){
+        closeIndex(index);
+        return 1;
+    }
+    index->gameOffsets = (const uint64_t *)(index->header + 1);
+    index->entries = (const indexEntry *)(index->gameOffsets + index->header->gameCount);
+    return 0;
+}
+// Unmaps an index
+void closeIndex(gameIndex *index){
+    unmapFile(index->map, index->size);
+    index->map = NULL;
+}
+// Returns the first entry with the given key, or the entry count if there is none
+// A binary search over the mapped entries, so only O(log n) pages are touched
+size_t findPosition(const gameIndex *index, uint64_t key){
+    size_t lo = 0, hi = index->header->entryCount;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if(index->entries[mid].key < key){
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if(lo < index->header->entryCount && index->entries[lo].key == key){
+        return lo;
+    }
+    return index->header->entryCount;
+}
+//}
+
+//{ Position classification
+// Labels a FEN/EPD position as checkmate, stalemate, check N or legal N, where N is the number of legal moves
+void classifyPosition(piece ***board, const char *fen, char *label){
+    if(!loadFen(board, fen)){
+        strcpy(label, "invalid");
+        return;
+    }
+    int player = turn % 2;
+    int check = cacheCheck(board, player);
+    // Every move is played through makeMove, so en passant captures that lift the check are counted too
+    int cnt = countLegalMoves(board, player);
+    // The only difference between a stalemate and a checkmate is whether the king is in check
+    if(cnt == 0){
+        strcpy(label, check ? "checkmate" : "stalemate");
+        return;
+    }
+    sprintf(label, "%s %d", check ? "check" : "legal", cnt);
+}
+// Labels lines handed out by the batch until there are none left
+void *runClassifyWorker(void *arg){
+    classifyBatch *batch = arg;
+    piece ***board = makeBoard();
+    int line;
+    while((line = atomic_fetch_add(&batch->nextLine, 1)) < batch->cnt){
+        classifyPosition(board, batch->lines[line], batch->labels[line]);
+    }
+    freeBoard(board);
+    freePools();
+    return NULL;
+}
+// Reads up to BATCH_LINES lines into a batch, dropping newlines and anything past MAX_LINE. Returns the number read
+int readBatch(FILE *in, classifyBatch *batch){
+    batch->cnt = 0;
+    atomic_store(&batch->nextLine, 0);
+    while(batch->cnt < BATCH_LINES && fgets(batch->lines[batch->cnt], MAX_LINE, in) != NULL){
+        char *line = batch->lines[batch->cnt];
+        size_t len = strcspn(line, "\r\n");
+        if(line[len] == '\0' && len == MAX_LINE - 1){
+            int c;
+            while((c = fgetc(in)) != '\n' && c != EOF);
+        }
+        line[len] = '\0';
+        batch->cnt++;
+    }
+    return batch->cnt;
+}
+// Labels every position in a FEN/EPD file (or stdin for "-") and writes "line<TAB>label" to stdout in input order
+// Lines are read in fixed-size batches, so memory use doesn't grow with the input. The next batch is read while
+// the workers label the current one. Returns 0 on success
+int classifyFile(const char *path, int threads){
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if(in == NULL){
+        printf("Could not read %s\n", path);
+        return 1;
+    }
+    if(threads < 1 || threads > MAX_THREADS){
+        threads = numCores();
+    }
+    classifyBatch batches[2];
+    int res = 0;
+    for(int i = 0; i < 2; i++){
+        batches[i].lines = malloc(BATCH_LINES * sizeof(*batches[i].lines));
+        batches[i].labels = malloc(BATCH_LINES * sizeof(*batches[i].labels));
+        batches[i].cnt = 0;
+        if(batches[i].lines == NULL || batches[i].labels == NULL){
+            res = 1;
+        }
+    }
+    if(res != 0){
+        printf("Out of memory classifying %s\n", path);
+    }
+
+    pthread_t workers[MAX_THREADS];
+    int started[MAX_THREADS];
+    int cur = 0;
+    if(res == 0){
+        readBatch(in, &batches[cur]);
+    }
+    while(batches[cur].cnt > 0){
+        for(int i = 0; i < threads; i++){
+            started[i] = pthread_create(&workers[i], NULL, runClassifyWorker, &batches[cur]) == 0;
+        }
+        readBatch(in, &batches[!cur]);
+        // Any worker that could not get a thread does its share here instead
+        for(int i = 0; i < threads; i++){
+            if(!started[i]){
+                runClassifyWorker(&batches[cur]);
+            }
+        }
+        for(int i = 0; i < threads; i++){
+            if(started[i]){
+                pthread_join(workers[i], NULL);
+            }
+        }
+        for(int i = 0; i < batches[cur].cnt; i++){
+            printf("%s\t%s\n", batches[cur].lines[i], batches[cur].labels[i]);
+        }
+        cur = !cur;
+    }
+
+    for(int i = 0; i < 2; i++){
+        free(batches[i].lines);
+        free(batches[i].labels);
+    }
+    if(in != stdin){
+        fclose(in);
+    }
+    return res;
+}
+//}
+
+//{ Mate solver
+// Finds the shortest forced mate for the player to move of at most maxMoves moves, using a node table of
+// memory bytes. Each length is tried in turn with proof-number search
+// Returns the length of the mate, 0 if there is none, or -1 if the node table filled up before an answer was found
+// Either way solver->disproven holds the longest length for which there is no mate
+int solveMate(piece ***board, int maxMoves, size_t memory, mateSolver *solver){
+    solver->cap = memory / sizeof(mateNode);
+    solver->nodes = malloc(solver->cap * sizeof(mateNode));
+    solver->expanded = 0;
+    solver->disproven = 0;
+    if(solver->nodes == NULL || solver->cap == 0){
+        return -1;
+    }
+    for(int moves = 1; moves <= maxMoves; moves++){
+        int res = proveMate(solver, board, moves);
+        if(res != 0){
+            return res == 1 ? moves : -1;
+        }
+        solver->disproven = moves;
+    }
+    return 0;
+}
+// Runs proof-number search for a mate in the given number of moves. The position is restored afterwards
+// Returns 1 if a mate was proven, 0 if disproven, or -1 if the node table filled up
+int proveMate(mateSolver *solver, piece ***board, int moves){
+    // The defender moves last at ply 2 * moves - 1, and must be mated there
+    int maxPly = 2 * moves - 1;
+    mateNode *nodes = solver->nodes;
+    nodes[0] = (mateNode) { { { 0 } }, 1, 1, -1, -1, 0 };
+    solver->used = 1;
+    solver->full = 0;
+
+    while(nodes[0].proof != 0 && nodes[0].disproof != 0 && !solver->full){
+        // Walk down to the most-proving node: the attacker follows the smallest proof number
+        // and the defender the smallest disproof number
+        int32_t idx = 0;
+        int ply = 0;
+        while(nodes[idx].firstChild != -1){
+            mateNode *node = &nodes[idx];
+            int32_t best = node->firstChild;
+            for(int32_t c = node->firstChild; c < node->firstChild + node->childCnt; c++){
+                if((ply % 2 == 0 && nodes[c].proof < nodes[best].proof)
+                   || (ply % 2 == 1 && nodes[c].disproof < nodes[best].disproof)){
+                    best = c;
+                }
+            }
+            idx = best;
+            promoteTo = (nodes[idx].mv.promo == None) ? Queen : nodes[idx].mv.promo;
+            makeMove(board, nodes[idx].mv.start, nodes[idx].mv.end);
+            ply++;
+        }
+        expandMateNode(solver, board, idx, ply, maxPly);
+
+        // Back up the new numbers, undoing moves on the way to the root
+        while(idx != 0){
+            idx = nodes[idx].parent;
+            ply--;
+            moveRecords = undoMove(moveRecords, board);
+            updateMateNode(solver, idx, ply);
+        }
+    }
+    if(nodes[0].proof == 0){
+        return 1;
+    }
+    return nodes[0].disproof == 0 ? 0 : -1;
+}
+// Generates the children of a leaf, or scores it if the game is over or the move limit is reached
+void expandMateNode(mateSolver *solver, piece ***board, int32_t idx, int ply, int maxPly){
+    mateNode *node = &solver->nodes[idx];
+    int player = turn % 2, attacking = (ply % 2 == 0);
+    legalMove moves[MAX_LEGAL];
+    cacheCheck(board, player);
+    // At the move limit it only matters whether the defender has any move at all, so skip the ordering there
+    // Elsewhere forcing moves come first, which is where the proof-number search looks first among equal children
+    int cnt = (ply == maxPly) ? getLegalMoves(board, player, moves, 1) : getOrderedMoves(board, player, moves, MAX_LEGAL);
+    solver->expanded++;
+
+    // A position with no legal moves is only a win if it is the defender who is checkmated
+    if(cnt == 0){
+        int mated = !attacking && kingPos[player].flag;
+        node->proof = mated ? 0 : PN_INF;
+        node->disproof = mated ? PN_INF : 0;
+        return;
+    }
+    if(ply == maxPly){
+        node->proof = PN_INF;
+        node->disproof = 0;
+        return;
+    }
+    if(solver->used + cnt > solver->cap){
+        solver->full = 1;
+        return;
+    }
+    node->firstChild = solver->used;
+    node->childCnt = cnt;
+    for(int i = 0; i < cnt; i++){
+        solver->nodes[solver->used++] = (mateNode) { moves[i], 1, 1, idx, -1, 0 };
+    }
+    updateMateNode(solver, idx, ply);
+}
+// Recomputes a node's numbers from its children. The attacker needs one proven move, the defender all of them
+void updateMateNode(mateSolver *solver, int32_t idx, int ply){
+    mateNode *node = &solver->nodes[idx];
+    uint32_t minNum = PN_INF, sum = 0;
+    for(int32_t c = node->firstChild; c < node->firstChild + node->childCnt; c++){
+        uint32_t minChild = (ply % 2 == 0) ? solver->nodes[c].proof : solver->nodes[c].disproof;
+        uint32_t sumChild = (ply % 2 == 0) ? solver->nodes[c].disproof : solver->nodes[c].proof;
+        minNum = minChild < minNum ? minChild : minNum;
+        sum = (sum + sumChild > PN_INF) ? PN_INF : sum + sumChild;
+    }
+    node->proof = (ply % 2 == 0) ? minNum : sum;
+    node->disproof = (ply % 2 == 0) ? sum : minNum;
+}
+// Prints the proven mating line, following one of the defender's replies at each step
+void printMateLine(const mateSolver *solver){
+    const mateNode *nodes = solver->nodes;
+    int32_t idx = 0;
+    for(int ply = 0; nodes[idx].firstChild != -1; ply++){
+        int32_t next = nodes[idx].firstChild;
+        while(ply % 2 == 0 && nodes[next].proof != 0){
+            next++;
+        }
+        idx = next;
+        printf(" ");
+        printEncodedMove(encodeMove(nodes[idx].mv.start, nodes[idx].mv.end, nodes[idx].mv.promo));
+    }
+}
+// Solves a FEN position for mate and prints the result with the search speed. Returns 0 unless the FEN is invalid
+int mateCommand(const char *fen, int maxMoves, size_t memory){
+    piece ***board = makeBoard();
+    if(!loadFen(board, fen)){
+        printf("Invalid FEN: %s\n", fen);
+        freeBoard(board);
+        return 1;
+    }
+    mateSolver solver;
+    clock_t start = clock();
+    int res = solveMate(board, maxMoves, memory, &solver);
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    if(res > 0){
+        printf("Mate in %d:", res);
+        printMateLine(&solver);
+        printf("\n");
+    } else if(res == 0){
+        printf("No mate in %d or fewer moves\n", maxMoves);
+    } else {
+        if(solver.disproven > 0){
+            printf("No mate in %d or fewer moves; unknown at %d (node table full, %zu nodes)\n",
+                   solver.disproven, solver.disproven + 1, solver.cap);
+        } else {
+            printf("Unknown: node table full (%zu nodes)\n", solver.cap);
+        }
+    }
+    printf("%llu nodes in %.3f s (%.0f nodes/s)\n", (unsigned long long)solver.expanded, seconds,
+           seconds > 0 ? solver.expanded / seconds : 0.0);
+    free(solver.nodes);
+    freeBoard(board);
+    freePools();
+    return 0;
+}
+//}
+
+//{ Rules fuzzer
+// Plays games handed out by the job until there are none left
+void *runFuzzWorker(void *arg){
+    fuzzWorker *worker = arg;
+    fuzzJob *job = worker->job;
+    piece ***board = makeBoard();
+    uint32_t game;
+    while((game = atomic_fetch_add(&job->nextGame, 1)) < job->gameCount){
+        worker->failures += fuzzGame(board, job, game, &worker->moves);
+        worker->games++;
+    }
+    freeBoard(board);
+    freePools();
+    return NULL;
+}
+// Plays one random legal game with makeMove, then takes it all back with undoMove
+// Every position is cross-checked along the way and every undo must restore the position exactly
+// Each game's moves depend only on the seed and game number, so failures can be replayed. Returns the failure count
+int fuzzGame(piece ***board, fuzzJob *job, uint32_t game, uint64_t *moves){
+    position history[MAX_FUZZ_PLIES], now, copied;
+    legalMove played[MAX_FUZZ_PLIES];
+    legalMove legal[MAX_LEGAL], ordered[MAX_LEGAL];
+    uint64_t rng = job->seed ^ ((uint64_t)game << 32);
+    int failures = 0, ply;
+
+    clearBoard(board);
+    freeMoves(moveRecords);
+    moveRecords = NULL;
+    turn = 0;
+    readyBoard(board);
+    for(ply = 0; ply < MAX_FUZZ_PLIES; ply++){
+        int player = turn % 2;
+        int check = cacheCheck(board, player);
+        int cnt = getLegalMoves(board, player, legal, MAX_LEGAL);
+        failures += fuzzCheck(job, kingsMatch(board), "kingPos does not match the kings on the board", game, ply, played);
+        failures += fuzzCheck(job, check == isCheckReference(board, player), "isCheck disagrees with a full move scan", game, ply, played);
+        failures += fuzzCheck(job, isStalemate(board, player) == (cnt == 0), "isStalemate disagrees with the legal move count", game, ply, played);
+        failures += fuzzCheck(job, getOrderedMoves(board, player, ordered, MAX_LEGAL) == cnt, "staged generator finds a different number of legal moves", game, ply, played);
+        for(int i = 0; i < cnt; i++){
+            failures += fuzzCheck(job, !isSimulatedCheck(board, legal[i].start.rank, legal[i].start.file, legal[i].end.rank, legal[i].end.file, player),
+                                  "isSimulatedCheck rejects a legal move", game, ply, played);
+        }
+        if(cnt == 0){
+            break;
+        }
+
+        // Copy-make the chosen move first, and expect the same result as making it
+        played[ply] = legal[splitmix(&rng) % cnt];
+        failures += fuzzCheck(job, copyMake(board, &history[ply], played[ply]), "copyMake rejected a legal move", game, ply + 1, played);
+        savePosition(board, &copied);
+        loadPosition(board, &history[ply]);
+        savePosition(board, &now);
+        failures += fuzzCheck(job, samePosition(&now, &history[ply]), "loadPosition did not restore the position", game, ply, played);
+
+        promoteTo = (played[ply].promo == None) ? Queen : played[ply].promo;
+        failures += fuzzCheck(job, makeMove(board, played[ply].start, played[ply].end), "legal move was rejected", game, ply + 1, played);
+        savePosition(board, &now);
+        failures += fuzzCheck(job, samePosition(&now, &copied), "copyMake and makeMove reached different positions", game, ply + 1, played);
+        (*moves)++;
+    }
+
+    // Take the whole game back. After a bad undo every later one would fail too, so stop there
+    while(ply-- > 0){
+        moveRecords = undoMove(moveRecords, board);
+        savePosition(board, &now);
+        if(fuzzCheck(job, samePosition(&now, &history[ply]), "undoMove did not restore the position", game, ply + 1, played)){
+            failures++;
+            break;
+        }
+    }
+    return failures;
+}
+// Reports a failed check (the first few only) with the moves that led to it. Returns 1 if the check failed
+int fuzzCheck(fuzzJob *job, int ok, const char *what, uint32_t game, int ply, const legalMove *played){
+    if(ok){
+        return 0;
+    }
+    if(atomic_fetch_add(&job->reports, 1) < MAX_FUZZ_REPORTS){
+        // Built up front so that lines from different threads don't interleave
+        char line[MAX_FUZZ_PLIES * 6 + 128];
+        int len = sprintf(line, "FAIL game %u ply %d: %s\n ", game, ply, what);
+        for(int i = 0; i < ply; i++){
+            uint16_t code = encodeMove(played[i].start, played[i].end, played[i].promo);
+            int start = code & 63, end = (code >> 6) & 63;
+            len += sprintf(line + len, " %c%d%c%d", 'a' + start % BOARD_SIZE, BOARD_SIZE - start / BOARD_SIZE,
+                           'a' + end % BOARD_SIZE, BOARD_SIZE - end / BOARD_SIZE);
+            if(played[i].promo != None){
+                line[len++] = pieceTypes[played[i].promo].rep + UPPER;
+            }
+        }
+        printf("%s\n", line);
+    }
+    return 1;
+}
+// Returns 1 if the player's king can be captured, by scanning every enemy piece's full move list
+// This is how isCheck used to work, kept as a reference for the staged generator
+int isCheckReference(piece ***board, int owner){
+    int cnt = 0, flag;
+    for(int i = 0; i < BOARD_SIZE; i++){
+        for(int j = 0; j < BOARD_SIZE; j++){
+            if(isEnemyPiece(i, j, owner, board)){
+                move *possibleMoves = board[i][j]->getPossibleMoves(i, j, board, (owner + 1) % 2, &cnt);
+                int res = isPossibleMove(kingPos[owner].rank, kingPos[owner].file, possibleMoves, cnt, &flag);
+                free(possibleMoves);
+                if(res){
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+// Returns 1 if both saved king positions hold that player's king
+int kingsMatch(piece ***board){
+    for(int owner = 0; owner < 2; owner++){
+        piece *king = board[kingPos[owner].rank][kingPos[owner].file];
+        if(king == NULL || king->type != King || king->owner != owner){
+            return 0;
+        }
+    }
+    return 1;
+}
+// Returns 1 if two snapshots are identical, ignoring the cached check flags in kingPos
+int samePosition(const position *a, const position *b){
+    return memcmp(a->squares, b->squares, sizeof(a->squares)) == 0 && a->turn == b->turn
+           && a->kingPos[0].rank == b->kingPos[0].rank && a->kingPos[0].file == b->kingPos[0].file
+           && a->kingPos[1].rank == b->kingPos[1].rank && a->kingPos[1].file == b->kingPos[1].file;
+}
+// Plays random legal games on several threads, then prints the failure count and throughput
+// Returns 0 if every check passed
+int fuzzRules(uint32_t games, uint64_t seed, int threads){
+    if(threads < 1 || threads > MAX_THREADS){
+        threads = numCores();
+    }
+    fuzzJob job = { seed, games };
+    atomic_init(&job.nextGame, 0);
+    atomic_init(&job.reports, 0);
+    fuzzWorker workers[MAX_THREADS] = { { 0 } };
+
+    double start = wallTime();
+    for(int i = 0; i < threads; i++){
+        workers[i].job = &job;
+        workers[i].started = pthread_create(&workers[i].thread, NULL, runFuzzWorker, &workers[i]) == 0;
+    }
+    // Any worker that could not get a thread does its share here instead
+    for(int i = 0; i < threads; i++){
+        if(!workers[i].started){
+            runFuzzWorker(&workers[i]);
+        }
+    }
+    uint64_t played = 0, moves = 0, failures = 0;
+    for(int i = 0; i < threads; i++){
+        if(workers[i].started){
+            pthread_join(workers[i].thread, NULL);
+        }
+        played += workers[i].games;
+        moves += workers[i].moves;
+        failures += workers[i].failures;
+    }
+    double seconds = wallTime() - start;
+
+    printf("%llu games, %llu moves, %llu failures in %.2f s using %d threads (seed %llu)\n",
+           (unsigned long long)played, (unsigned long long)moves, (unsigned long long)failures, seconds, threads,
+           (unsigned long long)seed);
+    if(seconds > 0){
+        printf("%.0f games/s, %.0f moves/s\n", played / seconds, moves / seconds);
+    }
+    return failures != 0;
+}
+// Returns the wall clock time in seconds, for measuring work spread over several threads
+double wallTime(){
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+//}
+
+//{ Platform
+// Maps a whole file read-only. Returns NULL if the file can't be read or is empty
+const void *mapFile(const char *path, size_t *size){
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE){
+        return NULL;
+    }
+    LARGE_INTEGER fileSize;
+    void *map = NULL;
+    if(GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0){
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(mapping != NULL){
+            map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = fileSize.QuadPart;
+    }
+    CloseHandle(file);
+    return map;
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        return NULL;
+    }
+    struct stat st;
+    void *map = NULL;
+    if(fstat(fd, &st) == 0 && st.st_size > 0){
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED){
+            map = NULL;
+        }
+        *size = st.st_size;
+    }
+    close(fd);
+    return map;
+#endif
+}
+// Unmaps a file mapped by mapFile
+void unmapFile(const void *map, size_t size){
+    if(map == NULL){
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(map);
+#else
+    munmap((void *)map, size);
+#endif
+}
+// Returns the number of available cores, capped at MAX_THREADS
+int numCores(){
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int cores = info.dwNumberOfProcessors;
+#else
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(cores < 1){
+        return 1;
+    }
+    return cores > MAX_THREADS ? MAX_THREADS : cores;
+}
+//}
+
+//{ Command line
+// Runs a batch command instead of the interactive menu. Returns the process exit code
+int runCommand(int argc, char **argv){
+    if(strcmp(argv[0], "index") == 0 && argc >= 2){
+        char *indexPath = indexPathFor(argv[1]);
+        int res = buildIndex(argv[1], indexPath, argc >= 3 ? atoi(argv[2]) : numCores());
+        free(indexPath);
+        return res;
+    }
+    if(strcmp(argv[0], "find") == 0 && argc >= 2){
+        return findGames(argv[1], argv + 2, argc - 2);
+    }
+    if(strcmp(argv[0], "classify") == 0 && argc >= 2){
+        return classifyFile(argv[1], argc >= 3 ? atoi(argv[2]) : numCores());
+    }
+    // DEPTH and MB must both be at least 1, otherwise the usage is shown
+    if(strcmp(argv[0], "mate") == 0 && argc >= 3 && atoi(argv[2]) >= 1 && (argc < 4 || atoi(argv[3]) >= 1)){
+        size_t memory = (size_t)(argc >= 4 ? atoi(argv[3]) : MATE_MEMORY) << 20;
+        return mateCommand(argv[1], atoi(argv[2]), memory);
+    }
+    if(strcmp(argv[0], "fuzz") == 0 && argc >= 2){
+        uint64_t seed = (argc >= 3) ? strtoull(argv[2], NULL, 10) : (uint64_t)time(NULL);
+        return fuzzRules(strtoul(argv[1], NULL, 10), seed, argc >= 4 ? atoi(argv[3]) : numCores());
+    }
+    printf("Usage:\n");
+    printf("  chess                          Play interactively\n");
+    printf("  chess index GAMES [THREADS]    Index every position in GAMES (one game per line, e.g. e2e4 e7e5)\n");
+    printf("  chess find GAMES [MOVES...]    List indexed games that reach the position after MOVES\n");
+    printf("  chess classify EPD [THREADS]   Label each FEN/EPD line (- for stdin) as checkmate, stalemate, check N or legal N\n");
+    printf("  chess mate FEN DEPTH [MB]      Find the shortest forced mate of at most DEPTH moves using MB of nodes\n");
+    printf("  chess fuzz GAMES [SEED] [THREADS]  Play random games checking the rules against themselves, and time them\n");
+    return 1;
+}
+// Prints every game in the index of gamePath that reached the position after the given moves
+int findGames(const char *gamePath, char **moves, int cnt){
+    piece ***board = makeBoard();
+    turn = 0;
+    readyBoard(board);
+    for(int i = 0; i < cnt; i++){
+        move cur, tar;
+        Type promo;
+        int len = parseMove(moves[i], strlen(moves[i]), &cur, &tar, &promo);
+        promoteTo = (promo == None) ? Queen : promo;
+        cacheCheck(board, turn % 2);
+        if(len == 0 || !tryMove(board, cur, tar)){
+            printf("Illegal move: %s\n", moves[i]);
+            freeBoard(board);
+            freePools();
+            return 1;
+        }
+    }
+    uint64_t key = positionKey(board);
+    freeBoard(board);
+    freePools();
+
+    gameIndex index;
+    char *indexPath = indexPathFor(gamePath);
+    int res = openIndex(indexPath, &index);
+    if(res != 0){
+        printf("Could not open index %s\n", indexPath);
+        free(indexPath);
+        return 1;
+    }
+    free(indexPath);
+
+    size_t games;
+    const char *text = mapFile(gamePath, &games);
+    size_t found = 0;
+    for(size_t i = findPosition(&index, key); i < index.header->entryCount && index.entries[i].key == key; i++){
+        const indexEntry *entry = &index.entries[i];
+        printf("Game %u, ply %u: next ", entry->game + 1, entry->ply);
+        printEncodedMove(entry->next);
+        // Show the stored game, if the game file is still there
+        uint64_t offset = index.gameOffsets[entry->game];
+        if(text != NULL && offset < games){
+            const char *end = memchr(text + offset, '\n', games - offset);
+            int len = (end == NULL) ? (int)(games - offset) : (int)(end - text - offset);
+            printf("  | %.*s", len, text + offset);
+        }
+        printf("\n");
+        found++;
+    }
+    printf("%zu matching positions\n", found);
+    unmapFile(text, games);
+    closeIndex(&index);
+    return 0;
+}
+// Returns the path of the index for a game file (the game file's path plus .idx). Caller frees
+char *indexPathFor(const char *gamePath){
+    char *path = malloc(strlen(gamePath) + 5);
+    strcpy(path, gamePath);
+    strcat(path, ".idx");
+    return path;
+}
 //}